@@ -0,0 +1,634 @@
+/*
+ * diff.c - compares two builds of the same module.
+ *
+ * Both modules are first scanned without decoding anything: every section gets a hash of its
+ * (offset, len) range and every function body a hash of its code->size range. Only the sections
+ * and bodies whose hashes differ are then decoded and compared, so two big modules with a handful
+ * of changes cost about as much as reading their bytes once.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "s_wasm.h"
+
+#define HASH_CHUNK 0x100000
+
+#define P1 0x9E3779B185EBCA87ULL
+#define P2 0xC2B2AE3D27D4EB4FULL
+#define P3 0x165667B19E3779F9ULL
+#define P4 0x85EBCA77C2B2AE63ULL
+#define P5 0x27D4EB2F165667C5ULL
+
+#define ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+typedef struct {
+  size_t offset; /* of the size field, which is where read_code() wants to start */
+  u32 size;
+  u64 hash;
+} body_t;
+
+typedef struct {
+  FILE *fp;
+  module_t m; /* section headers only, nothing is decoded until we know it changed */
+  body_t *bodies;
+  u32 nbodies;
+  u32 nimports; /* imported functions, only counted once something changed */
+  byte *buf;
+  size_t buf_cap;
+} summary_t;
+
+u64 read_u64_le(const byte *p) {
+  u64 v;
+
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+u64 hash_round(u64 acc, u64 input) {
+  acc += input * P2;
+  acc = ROTL(acc, 31);
+  return acc * P1;
+}
+
+u64 hash_merge(u64 acc, u64 v) {
+  acc ^= hash_round(0, v);
+  return acc * P1 + P4;
+}
+
+u64 hash_bytes(const byte *p, size_t len, u64 seed) {
+  /*
+   * xxHash64. Four independent lanes over 32 byte stripes keep the multipliers busy, which is what
+   * lets us hash at close to memory speed.
+   */
+  const byte *end = p + len;
+  u64 h, v1, v2, v3, v4;
+  u32 w;
+
+  if (len >= 32) {
+    v1 = seed + P1 + P2;
+    v2 = seed + P2;
+    v3 = seed;
+    v4 = seed - P1;
+    do {
+      v1 = hash_round(v1, read_u64_le(p));
+      v2 = hash_round(v2, read_u64_le(p + 8));
+      v3 = hash_round(v3, read_u64_le(p + 16));
+      v4 = hash_round(v4, read_u64_le(p + 24));
+      p += 32;
+    } while (end - p >= 32);
+
+    h = ROTL(v1, 1) + ROTL(v2, 7) + ROTL(v3, 12) + ROTL(v4, 18);
+    h = hash_merge(h, v1);
+    h = hash_merge(h, v2);
+    h = hash_merge(h, v3);
+    h = hash_merge(h, v4);
+  } else {
+    h = seed + P5;
+  }
+
+  h += len;
+
+  for (; end - p >= 8; p += 8) {
+    h ^= hash_round(0, read_u64_le(p));
+    h = ROTL(h, 27) * P1 + P4;
+  }
+  if (end - p >= 4) {
+    memcpy(&w, p, sizeof(w));
+    h ^= (u64)w * P1;
+    h = ROTL(h, 23) * P2 + P3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    h ^= *p * P5;
+    h = ROTL(h, 11) * P1;
+  }
+
+  h ^= h >> 33;
+  h *= P2;
+  h ^= h >> 29;
+  h *= P3;
+  h ^= h >> 32;
+  return h;
+}
+
+byte *summary_buf(summary_t *sm, size_t len) {
+  if (len > sm->buf_cap) {
+    sm->buf_cap = len;
+    sm->buf = realloc(sm->buf, len);
+  }
+  return sm->buf;
+}
+
+u64 hash_section(summary_t *sm, section_t *s) {
+  /* big sections are hashed a chunk at a time, each chunk seeded with the hash so far */
+  size_t left = s->len, n;
+  u64 h = 0;
+  byte *chunk;
+
+  chunk = summary_buf(sm, HASH_CHUNK);
+  while (left) {
+    n = left < HASH_CHUNK ? left : HASH_CHUNK;
+    read_many_bytes(sm->fp, n, chunk);
+    h = hash_bytes(chunk, n, h);
+    left -= n;
+  }
+  return h;
+}
+
+void hash_bodies(summary_t *sm) {
+  /*
+   * codesec ::= code* : section10(vec(code))
+   * code    ::= size:u32 code:func
+   *
+   * We only need the size of each body to find the next one.
+   */
+  body_t *b;
+  byte *body;
+  u32 i;
+
+  sm->nbodies = read_u32(sm->fp);
+  sm->bodies = calloc(sm->nbodies ? sm->nbodies : 1, sizeof(body_t));
+
+  for (i = 0; i < sm->nbodies; i++) {
+    b = &sm->bodies[i];
+    b->offset = ftell(sm->fp);
+    b->size = read_u32(sm->fp);
+
+    body = summary_buf(sm, b->size);
+    read_many_bytes(sm->fp, b->size, body);
+    b->hash = hash_bytes(body, b->size, 0);
+  }
+}
+
+void scan_module(const char *path, summary_t *sm) {
+  section_t *s, **tail;
+  size_t file_size;
+  u32 nfuncs = 0;
+
+  memset(sm, 0, sizeof(summary_t));
+  sm->fp = fopen(path, "r");
+  if (!sm->fp)
+    bye("could not open wasm file: %s\n", path);
+
+  fseek(sm->fp, 0L, SEEK_END);
+  file_size = ftell(sm->fp);
+  fseek(sm->fp, 0L, SEEK_SET);
+
+  read_magic(sm->fp, &sm->m);
+  read_version(sm->fp, &sm->m);
+
+  for (tail = &sm->m.sections; (size_t)ftell(sm->fp) < file_size; tail = &s->next) {
+    s = read_section_header(sm->fp);
+    *tail = s;
+
+    if (s->type == 0x1) {
+      sm->m.typesec = s;
+    } else if (s->type == 0x3) {
+      sm->m.funcsec = s;
+    } else if (s->type == 0x7) {
+      sm->m.exportssec = s;
+    } else if (s->type == 0xa) {
+      sm->m.codesec = s;
+    }
+
+    if (s == sm->m.codesec)
+      hash_bodies(sm);
+    else
+      s->hash = hash_section(sm, s);
+
+    fseek(sm->fp, s->content + s->len, SEEK_SET);
+  }
+
+  /* a build cut off at a section boundary still scans, but its function and code sections disagree */
+  if (sm->m.funcsec) {
+    fseek(sm->fp, sm->m.funcsec->content, SEEK_SET);
+    nfuncs = read_u32(sm->fp);
+  }
+  if (nfuncs != sm->nbodies)
+    bye("%s: function section has %u entries, but the code section has %u\n", path, nfuncs,
+        sm->nbodies);
+}
+
+section_t *find_section(summary_t *sm, section_t *like, byte *paired) {
+  /* sections pair up by type, custom sections by name (in order if a name repeats) */
+  section_t *s;
+  u32 i;
+
+  for (s = sm->m.sections, i = 0; s; s = s->next, i++) {
+    if (paired[i] || s->type != like->type)
+      continue;
+    if (s->type == 0x0 && strcmp((char *)s->name, (char *)like->name))
+      continue;
+    paired[i] = 1;
+    return s;
+  }
+  return NULL;
+}
+
+int bodies_differ(summary_t *a, summary_t *b) {
+  u32 i;
+
+  if (a->nbodies != b->nbodies)
+    return 1;
+  for (i = 0; i < a->nbodies; i++) {
+    if (a->bodies[i].hash != b->bodies[i].hash)
+      return 1;
+  }
+  return 0;
+}
+
+void print_section_name(section_t *s) {
+  if (s->type == 0x0)
+    printf("section custom(%s)", s->name);
+  else
+    printf("section type(%#x)", s->type);
+}
+
+int diff_sections(summary_t *a, summary_t *b) {
+  section_t *s, *t;
+  byte *paired;
+  u32 n = 0;
+  int changes = 0;
+
+  for (s = b->m.sections; s; s = s->next)
+    n++;
+  paired = calloc(n ? n : 1, 1);
+
+  for (s = a->m.sections; s; s = s->next) {
+    t = find_section(b, s, paired);
+    if (!t) {
+      print_section_name(s);
+      printf(": removed\n");
+      changes++;
+    } else if (s == a->m.codesec ? bodies_differ(a, b) : s->hash != t->hash) {
+      print_section_name(s);
+      printf(": changed, size %#lx -> %#lx\n", s->len, t->len);
+      changes++;
+    }
+  }
+
+  for (s = b->m.sections, n = 0; s; s = s->next, n++) {
+    if (!paired[n]) {
+      print_section_name(s);
+      printf(": added\n");
+      changes++;
+    }
+  }
+  free(paired);
+  return changes;
+}
+
+void decode_signatures(summary_t *sm) {
+  if (sm->m.typesec) {
+    fseek(sm->fp, sm->m.typesec->content, SEEK_SET);
+    sm->m.typesec->v = read_vec_functype(sm->fp);
+  }
+  if (sm->m.funcsec) {
+    fseek(sm->fp, sm->m.funcsec->content, SEEK_SET);
+    sm->m.funcsec->v = read_vec_indices(sm->fp);
+  }
+}
+
+functype_t *signature_of(summary_t *sm, u32 i) {
+  vector_t *types, *funcs;
+
+  if (!sm->m.typesec || !sm->m.funcsec)
+    return NULL;
+  types = sm->m.typesec->v;
+  funcs = sm->m.funcsec->v;
+  if (i >= funcs->nelts || funcs->pindices[i] >= types->nelts)
+    return NULL;
+  return types->pfuncs[funcs->pindices[i]];
+}
+
+int signature_eq(functype_t *x, functype_t *y) {
+  if (!x || !y)
+    return x == y;
+  return functype_eq(x, y);
+}
+
+void print_valtypes(vector_t *v) {
+  u32 i;
+
+  for (i = 0; i < v->nelts; i++)
+    printf(i ? " %s" : "%s", get_type_str(v->pvaltypes[i]));
+}
+
+void print_signature(functype_t *f) {
+  if (!f) {
+    printf("(?)");
+    return;
+  }
+  printf("(");
+  print_valtypes(f->parameters);
+  printf(") -> (");
+  print_valtypes(f->results);
+  printf(")");
+}
+
+void decode_exports(summary_t *sm) {
+  if (!sm->m.exportssec || sm->m.exportssec->v)
+    return;
+  fseek(sm->fp, sm->m.exportssec->content, SEEK_SET);
+  sm->m.exportssec->v = read_vec_exports(sm->fp);
+}
+
+u32 num_exports(summary_t *sm) {
+  return sm->m.exportssec ? sm->m.exportssec->v->nelts : 0;
+}
+
+int export_func(summary_t *sm, export_t *e, u32 *i) {
+  /*
+   * Exports use the function index space, which starts with the imported functions. Sets *i to
+   * the code section index if e exports a function defined in this module.
+   */
+  if (e->desc != 0x0 || e->idx < sm->nimports || e->idx - sm->nimports >= sm->nbodies)
+    return 0;
+  *i = e->idx - sm->nimports;
+  return 1;
+}
+
+byte **export_names(summary_t *sm) {
+  /* the first export name of every function, indexed by code section index */
+  vector_t *v;
+  byte **names;
+  u32 i, idx;
+
+  names = calloc(sm->nbodies ? sm->nbodies : 1, sizeof(byte *));
+  decode_exports(sm);
+
+  for (i = 0; i < num_exports(sm); i++) {
+    v = sm->m.exportssec->v;
+    if (export_func(sm, v->pexports[i], &idx) && !names[idx])
+      names[idx] = v->pexports[i]->name;
+  }
+  return names;
+}
+
+int export_cmp(const void *x, const void *y) {
+  return strcmp((char *)(*(export_t **)x)->name, (char *)(*(export_t **)y)->name);
+}
+
+export_t **sorted_exports(summary_t *sm) {
+  export_t **e;
+  u32 n = num_exports(sm);
+
+  e = calloc(n ? n : 1, sizeof(export_t *));
+  if (n) {
+    memcpy(e, sm->m.exportssec->v->pexports, n * sizeof(export_t *));
+    qsort(e, n, sizeof(export_t *), export_cmp);
+  }
+  return e;
+}
+
+int same_target(summary_t *a, export_t *x, summary_t *b, export_t *y) {
+  u32 i, j;
+
+  if (x->desc != y->desc)
+    return 0;
+  if (export_func(a, x, &i) && export_func(b, y, &j))
+    return i == j;
+  return x->idx == y->idx;
+}
+
+void mark_export(summary_t *sm, export_t *e, byte *marks, u32 n, const char *what) {
+  /* function exports are reported with their function, the rest get a line of their own */
+  u32 i;
+
+  if (e->desc != 0x0)
+    printf("export \"%s\" (type %#x): %s\n", e->name, e->desc, what);
+  else if (export_func(sm, e, &i) && i < n)
+    marks[i] = 1;
+}
+
+byte *diff_exports(summary_t *a, summary_t *b, u32 n) {
+  /*
+   * Exports are matched up by name. Returns a mark for every function (by code section index)
+   * that gained, lost or had an export retargeted, on either side.
+   */
+  export_t **ea, **eb;
+  byte *marks;
+  u32 i = 0, j = 0, na, nb;
+  int c;
+
+  decode_exports(a);
+  decode_exports(b);
+  na = num_exports(a);
+  nb = num_exports(b);
+  ea = sorted_exports(a);
+  eb = sorted_exports(b);
+  marks = calloc(n ? n : 1, 1);
+
+  while (i < na || j < nb) {
+    c = i == na ? 1 : j == nb ? -1 : strcmp((char *)ea[i]->name, (char *)eb[j]->name);
+    if (c < 0) {
+      mark_export(a, ea[i++], marks, n, "removed");
+    } else if (c > 0) {
+      mark_export(b, eb[j++], marks, n, "added");
+    } else {
+      if (!same_target(a, ea[i], b, eb[j])) {
+        /* both sides, unless that would print the same non function export twice */
+        mark_export(a, ea[i], marks, n, "changed");
+        if (ea[i]->desc == 0x0 || eb[j]->desc == 0x0)
+          mark_export(b, eb[j], marks, n, "changed");
+      }
+      i++;
+      j++;
+    }
+  }
+
+  free(ea);
+  free(eb);
+  return marks;
+}
+
+void print_exports(summary_t *sm, u32 i) {
+  vector_t *v;
+  u32 k, idx;
+  int first = 1;
+
+  printf("(");
+  for (k = 0; k < num_exports(sm); k++) {
+    v = sm->m.exportssec->v;
+    if (export_func(sm, v->pexports[k], &idx) && idx == i) {
+      printf(first ? "%s" : " %s", v->pexports[k]->name);
+      first = 0;
+    }
+  }
+  printf(")");
+}
+
+void print_func(u32 i, byte *name) {
+  if (name)
+    printf("func %u (%s)", i, name);
+  else
+    printf("func %u", i);
+}
+
+code_t *decode_body(summary_t *sm, u32 i) {
+  fseek(sm->fp, sm->bodies[i].offset, SEEK_SET);
+  return read_code(sm->fp);
+}
+
+void print_locals_diff(code_t *x, code_t *y) {
+  if (x->num_i32_locals != y->num_i32_locals)
+    printf(", i32 locals %u -> %u", x->num_i32_locals, y->num_i32_locals);
+  if (x->num_i64_locals != y->num_i64_locals)
+    printf(", i64 locals %u -> %u", x->num_i64_locals, y->num_i64_locals);
+  if (x->num_f32_locals != y->num_f32_locals)
+    printf(", f32 locals %u -> %u", x->num_f32_locals, y->num_f32_locals);
+  if (x->num_f64_locals != y->num_f64_locals)
+    printf(", f64 locals %u -> %u", x->num_f64_locals, y->num_f64_locals);
+  if (x->num_funcref_locals != y->num_funcref_locals)
+    printf(", funcref locals %u -> %u", x->num_funcref_locals, y->num_funcref_locals);
+  if (x->num_externref_locals != y->num_externref_locals)
+    printf(", externref locals %u -> %u", x->num_externref_locals, y->num_externref_locals);
+  if (x->num_vec_locals != y->num_vec_locals)
+    printf(", vector locals %u -> %u", x->num_vec_locals, y->num_vec_locals);
+}
+
+section_t *find_type(summary_t *sm, byte type) {
+  section_t *s;
+
+  for (s = sm->m.sections; s && s->type != type; s = s->next);
+  return s;
+}
+
+int section_changed(section_t *x, section_t *y) {
+  if (!x || !y)
+    return x != y;
+  return x->hash != y->hash;
+}
+
+void diff_functions(summary_t *a, summary_t *b) {
+  /*
+   * One line per function whose body, signature or exports changed, then a summary. Bodies pair
+   * up by code section index, but are labelled by function index like everywhere else.
+   */
+  byte **old_names = NULL, **new_names = NULL;
+  byte *exports = NULL;
+  functype_t *fa, *fb;
+  code_t *ca, *cb;
+  u32 i, n, nchanged = 0, nadded = 0, nremoved = 0;
+  const char *sep;
+  int sigs, body, exp;
+
+  /* the report and the exports use the function index space, which counts imports first */
+  a->nimports = count_func_imports(&a->m, a->fp);
+  b->nimports = count_func_imports(&b->m, b->fp);
+
+  /* function signatures only need decoding if the type or function section moved */
+  sigs = section_changed(a->m.typesec, b->m.typesec) || section_changed(a->m.funcsec, b->m.funcsec);
+  if (sigs) {
+    decode_signatures(a);
+    decode_signatures(b);
+  }
+
+  n = a->nbodies > b->nbodies ? a->nbodies : b->nbodies;
+
+  /* a different number of imported functions shifts what every function export points at */
+  if (section_changed(a->m.exportssec, b->m.exportssec)
+      || section_changed(find_type(a, 0x2), find_type(b, 0x2)))
+    exports = diff_exports(a, b, n);
+
+  for (i = 0; i < n; i++) {
+    body = i >= a->nbodies || i >= b->nbodies || a->bodies[i].hash != b->bodies[i].hash;
+    fa = sigs && i < a->nbodies ? signature_of(a, i) : NULL;
+    fb = sigs && i < b->nbodies ? signature_of(b, i) : NULL;
+    exp = exports && exports[i];
+    if (!body && !exp && signature_eq(fa, fb))
+      continue;
+
+    if (!new_names) {
+      /* labels for the report, only worth decoding the exports once something changed */
+      old_names = export_names(a);
+      new_names = export_names(b);
+    }
+
+    if (i >= b->nbodies) {
+      print_func(a->nimports + i, old_names[i]);
+      printf(": removed\n");
+      nremoved++;
+      continue;
+    }
+    if (i >= a->nbodies) {
+      print_func(b->nimports + i, new_names[i]);
+      printf(": added, size %#x\n", b->bodies[i].size);
+      nadded++;
+      continue;
+    }
+
+    print_func(b->nimports + i, new_names[i] ? new_names[i] : old_names[i]);
+    if (a->nimports != b->nimports)
+      printf(" (was func %u)", a->nimports + i);
+    printf(":");
+    sep = "";
+    if (!signature_eq(fa, fb)) {
+      printf(" signature ");
+      print_signature(fa);
+      printf(" => ");
+      print_signature(fb);
+      sep = ",";
+    }
+    if (exp) {
+      printf("%s exports ", sep);
+      print_exports(a, i);
+      printf(" => ");
+      print_exports(b, i);
+      sep = ",";
+    }
+    if (body) {
+      ca = decode_body(a, i);
+      cb = decode_body(b, i);
+      printf("%s body changed, size %#x -> %#x", sep, ca->size, cb->size);
+      print_locals_diff(ca, cb);
+      free(ca);
+      free(cb);
+    }
+    printf("\n");
+    nchanged++;
+  }
+
+  printf("%u functions compared: %u changed, %u added, %u removed\n", n, nchanged, nadded,
+         nremoved);
+
+  free(exports);
+  free(old_names);
+  free(new_names);
+}
+
+void free_summary(summary_t *sm) {
+  /* the vectors decoded on demand hang off the sections and are left to exit, like the reader's */
+  section_t *s, *next;
+
+  for (s = sm->m.sections; s; s = next) {
+    next = s->next;
+    free(s->name);
+    free(s);
+  }
+  fclose(sm->fp);
+  free(sm->bodies);
+  free(sm->buf);
+}
+
+int diff_modules(const char *old_path, const char *new_path) {
+  /*
+   * Prints one line per changed section, then the function report. Returns 0 if the modules are
+   * identical, 1 otherwise.
+   */
+  summary_t a, b;
+  int changes;
+
+  scan_module(old_path, &a);
+  scan_module(new_path, &b);
+
+  changes = diff_sections(&a, &b);
+  if (changes)
+    diff_functions(&a, &b);
+  else
+    printf("%u functions compared: 0 changed, 0 added, 0 removed\n", a.nbodies);
+
+  free_summary(&a);
+  free_summary(&b);
+  return changes ? 1 : 0;
+}
@@ -7,6 +7,18 @@ const char *get_type_str(byte type) {
   switch (type) {
   case 0x7f:
     return "i32";
+  case 0x7e:
+    return "i64";
+  case 0x7d:
+    return "f32";
+  case 0x7c:
+    return "f64";
+  case 0x7b:
+    return "v128";
+  case 0x70:
+    return "funcref";
+  case 0x6f:
+    return "externref";
   default:
     return "NYI";
   }
@@ -23,6 +23,7 @@ typedef struct {
 
 typedef struct {
   u32 size;
+  size_t offset; /* where the body (locals + expr) starts in the module file */
   u32 num_i32_locals;
   u32 num_i64_locals;
   u32 num_f32_locals;
@@ -62,27 +63,82 @@ struct _vector {
 
 /*
  * section = 1byte (type encoding) : u32 (length in bytes) : vec(<content>)
+ *
+ * offset points at the type byte, content at the first byte after the length. Custom sections
+ * (type 0x0) also carry their name.
  */
-typedef struct {
+typedef struct _section {
   size_t offset;
+  size_t content;
   size_t len;
   byte type;
+  byte *name;
+  u64 hash; /* of the contents, only filled in by diff mode */
   vector_t *v;
+  struct _section *next;
 } section_t;
 
 typedef struct {
   unsigned int magic:1;
   unsigned int version:1;
+  section_t *sections; /* every section in file order, including the ones we don't parse */
   section_t *typesec;
   section_t *funcsec;
   section_t *exportssec;
   section_t *codesec;
 } module_t;
 
+/*
+ * options for write_module(). strip lists the names of custom sections to drop, dedup_types
+ * merges identical function signatures and hot (if non-NULL) lists function indices hottest
+ * first; those functions are moved to the front of the code section.
+ */
+typedef struct {
+  char **strip;
+  int nstrip;
+  int dedup_types;
+  u32 *hot;
+  u32 nhot;
+} writer_opts_t;
+
+extern int bye_status;
+
+void bye(char *msg, ...);
+
+int read_many_bytes(FILE *fp, size_t size, unsigned char *buffer);
+
 byte read_one_byte(FILE *fp);
 
+u32 read_u32(FILE *fp);
+
 void pretty_print_module(module_t *);
 
+const char *get_type_str(byte type);
+
+section_t *read_section_header(FILE *fp);
+
+vector_t *read_vec_functype(FILE *fp);
+
+vector_t *read_vec_indices(FILE *fp);
+
+vector_t *read_vec_exports(FILE *fp);
+
+code_t *read_code(FILE *fp);
+
+int read_magic(FILE *fp, module_t *m);
+
+int read_version(FILE *fp, module_t *m);
+
 instr_t *read_instructions(FILE *fp);
 
+void write_module(module_t *m, FILE *in, FILE *out, writer_opts_t *opts);
+
+u32 *read_hot_profile(const char *path, u32 *n);
+
+u32 count_func_imports(module_t *m, FILE *in);
+
+int functype_eq(functype_t *a, functype_t *b);
+
+int diff_modules(const char *old_path, const char *new_path);
+
 #endif /* __S_WASM_H__ */
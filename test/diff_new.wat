@@ -0,0 +1,17 @@
+;; the new build for diff mode, see diff_old.wat
+(module
+  (func $answer (export "answer") (result i32)
+    i32.const 42)
+
+  (func $scale (export "scale") (param i32 i32) (result i32)
+    local.get 0
+    i32.const 2
+    i32.mul)
+
+  (func $twice (export "double") (param i32) (result i32)
+    local.get 0
+    local.get 0
+    i32.add)
+
+  (func $same (export "same") (result i32)
+    i32.const 7))
@@ -0,0 +1,18 @@
+;; the old build for diff mode, see test_diff in the Makefile. diff_new.wat changes the body of
+;; $answer, the signature of $scale (but not its body) and the name $twice is exported under.
+(module
+  (func $answer (export "answer") (result i32)
+    i32.const 41)
+
+  (func $scale (export "scale") (param i32) (result i32)
+    local.get 0
+    i32.const 2
+    i32.mul)
+
+  (func $twice (export "twice") (param i32) (result i32)
+    local.get 0
+    local.get 0
+    i32.add)
+
+  (func $same (export "same") (result i32)
+    i32.const 7))
@@ -0,0 +1,39 @@
+;; exercises the module writer: wat2wasm --debug-names writer.wat, then see test_writer in the
+;; Makefile. apply(5, 0) = 11, apply(5, 1) = 7, hot() = 42 before and after re-encoding.
+(module
+  ;; $sig_a and $sig_b are the same signature, -u merges them
+  (type $sig_a (func (param i32) (result i32)))
+  (type $nullary (func (result i32)))
+  (type $sig_b (func (param i32) (result i32)))
+  (type $pair (func (param i32 i32) (result i32)))
+
+  (table 2 funcref)
+  (elem (i32.const 0) $double $inc)
+
+  (func $double (type $sig_a) (param i32) (result i32)
+    local.get 0
+    local.get 0
+    i32.add)
+
+  (func $inc (type $sig_b) (param i32) (result i32)
+    local.get 0
+    i32.const 1
+    i32.add)
+
+  (func $add (type $pair) (param i32 i32) (result i32)
+    local.get 0
+    local.get 1
+    i32.add)
+
+  ;; the block takes a parameter, so it is encoded with a type index rather than a value type
+  (func $apply (export "apply") (type $pair) (param i32 i32) (result i32)
+    local.get 0
+    (block (type $sig_b) (param i32) (result i32)
+      local.get 1
+      call_indirect (type $sig_b))
+    call $inc)
+
+  (func $hot (export "hot") (type $nullary) (result i32)
+    i32.const 20
+    i32.const 22
+    call $add))
@@ -2,8 +2,10 @@
 #define __WASM_TYPES_H__
 
 #include <stdlib.h>
+#include <stdint.h>
 
 typedef uint32_t u32;
+typedef uint64_t u64;
 typedef int32_t  i32;
 typedef int64_t  i64;
 typedef float    f32;
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "s_wasm.h"
 
 #define VEC_SET_STORAGE(v, ptr, type) {                   \
@@ -10,13 +12,19 @@
      : calloc(v->nelts, sizeof(type));                    \
  }
 
+/* diff mode follows diff(1): 0 same, 1 different, 2 trouble */
+int bye_status = 1;
+
+/* stdout is the dump, -o turns it off */
+int dumping = 1;
+
 void bye(char *msg, ...) {
   va_list p;
 
   va_start(p, msg);
   vfprintf(stderr, msg, p);
   va_end(p);
-  exit(1);
+  exit(bye_status);
 }
 
 int read_many_bytes(FILE *fp, size_t size, unsigned char *buffer) {
@@ -149,6 +157,21 @@ functype_t *read_functype(FILE *fp) {
   return f;
 }
 
+byte *read_name(FILE *fp) {
+  /*
+   * name ::= 𝑏*:vec(byte) ⇒ name (if utf8(name) = 𝑏*)
+   */
+  byte *name;
+  u32 size;
+
+  size = read_u32(fp);
+
+  name = malloc(size + 1);
+  name[size] = '\0';
+  read_many_bytes(fp, size, name);
+  return name;
+}
+
 export_t *read_export(FILE *fp) {
   /*
    * export     ::= nm:name 𝑑:exportdesc       ⇒ {name nm , desc 𝑑} 
@@ -158,16 +181,10 @@ export_t *read_export(FILE *fp) {
    *             |  0x03 𝑥:globalidx           ⇒ global 𝑥
    */
   export_t *e;
-  u32 size;
 
   e = calloc(1, sizeof(export_t));
 
-  size = read_u32(fp);
-
-  e->name = malloc(size + 1);
-  e->name[size] = '\0';
-  read_many_bytes(fp, size, e->name);
-  
+  e->name = read_name(fp);
   e->desc = read_one_byte(fp);
   e->idx = read_u32(fp);
 
@@ -187,6 +204,7 @@ code_t *read_code(FILE *fp) {
   code = calloc(1, sizeof(code_t));
 
   code->size = read_u32(fp);
+  code->offset = ftell(fp);
   num_local_types = read_u32(fp);
 
   while (num_local_types--) {
@@ -195,25 +213,25 @@ code_t *read_code(FILE *fp) {
 
     switch (type) {
     case 0x70:
-      code->num_funcref_locals = size;
+      code->num_funcref_locals += size;
       break;
     case 0x6f:
-      code->num_externref_locals = size;
+      code->num_externref_locals += size;
       break;
     case 0x7b:
-      code->num_vec_locals = size;
+      code->num_vec_locals += size;
       break;
     case 0x7c:
-      code->num_f64_locals = size;
+      code->num_f64_locals += size;
       break;
     case 0x7d:
-      code->num_f32_locals = size;
+      code->num_f32_locals += size;
       break;
     case 0x7e:
-      code->num_i64_locals = size;
+      code->num_i64_locals += size;
       break;
     case 0x7f:
-      code->num_i32_locals = size;
+      code->num_i32_locals += size;
       break;
     default:
       bye("unexpected locals type(%#x)\n", type);
@@ -221,6 +239,9 @@ code_t *read_code(FILE *fp) {
   }
 
   code->instr = read_instructions(fp);
+
+  /* read_instructions() is not a full decoder yet, trust the body size to find the next one */
+  fseek(fp, code->offset + code->size, SEEK_SET);
   return code;
 }
   
@@ -294,10 +315,15 @@ vector_t *read_vec_code(FILE *fp) {
   return v;
 }
 
-void read_section(FILE *fp, module_t *m) {
+section_t *read_section_header(FILE *fp) {
   /*
    * section𝑁(B) ::= 𝑁:byte size:u32 cont:B ⇒ cont (if size = ||B||) 
    *               |  𝜖                      ⇒  𝜖
+   *
+   * customsec ::= section0(custom)
+   * custom    ::= name byte*
+   *
+   * Leaves fp at the start of the section contents.
    */
   section_t *s;
 
@@ -306,7 +332,23 @@ void read_section(FILE *fp, module_t *m) {
   s->offset = ftell(fp);
   s->type = read_one_byte(fp);
   s->len = read_u32(fp);
-  
+  s->content = ftell(fp);
+
+  if (s->type == 0x0) {
+    s->name = read_name(fp);
+    fseek(fp, s->content, SEEK_SET);
+  }
+  return s;
+}
+
+void read_section(FILE *fp, module_t *m) {
+  section_t *s, **tail;
+
+  s = read_section_header(fp);
+
+  for (tail = &m->sections; *tail; tail = &(*tail)->next);
+  *tail = s;
+
   if (s->type == 0x1) {
     /*
      * typesec ::= ft * : section1 (vec(functype)) ⇒ ft *
@@ -341,22 +383,85 @@ void read_section(FILE *fp, module_t *m) {
      * NYI section
      */
     s->v = NULL;
-    printf("Section type(%#x), size(%#lx bytes) is NYI ... skipping\n", s->type, s->len);
-    fseek(fp, s->len, SEEK_CUR);
+    if (dumping)
+      printf("Section type(%#x), size(%#lx bytes) is NYI ... skipping\n", s->type, s->len);
   }
+  fseek(fp, s->content + s->len, SEEK_SET);
+}
+
+int same_file(const char *a, const char *b) {
+  struct stat sa, sb;
+
+  return !stat(a, &sa) && !stat(b, &sb) && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+void usage(char *prog) {
+  bye("usage: %s [-o out.wasm [-s custom_section]... [-u] [-p hot_profile]] module.wasm\n"
+      "       %s -D old.wasm new.wasm\n"
+      "  -o  re-encode the module into out.wasm instead of dumping it\n"
+      "  -s  drop the named custom section (may be repeated)\n"
+      "  -u  merge identical function signatures in the type section\n"
+      "  -p  move the functions listed in hot_profile (one function index per line,\n"
+      "      hottest first) to the front of the code section\n"
+      "  -D  report the sections and functions that differ between two builds of a module,\n"
+      "      exits with 0 if there are none, 1 if there are any and 2 on errors\n", prog, prog);
 }
 
 
 int main(int argc, char **argv) {
   module_t m;
-  FILE *fp;
+  writer_opts_t opts;
+  FILE *fp, *out;
   size_t file_size;
+  char *out_path = NULL;
+  int c, diff = 0;
+
+  memset(&opts, 0, sizeof(writer_opts_t));
+
+  while ((c = getopt(argc, argv, "o:s:up:D")) != -1) {
+    switch (c) {
+    case 'D':
+      diff = 1;
+      bye_status = 2;
+      break;
+    case 'o':
+      out_path = optarg;
+      break;
+    case 's':
+      opts.strip = realloc(opts.strip, (opts.nstrip + 1) * sizeof(char *));
+      opts.strip[opts.nstrip++] = optarg;
+      break;
+    case 'u':
+      opts.dedup_types = 1;
+      break;
+    case 'p':
+      opts.hot = read_hot_profile(optarg, &opts.nhot);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (diff) {
+    if (optind != argc - 2)
+      usage(argv[0]);
+    return diff_modules(argv[optind], argv[optind + 1]);
+  }
+
+  if (optind != argc - 1)
+    usage(argv[0]);
 
+  if (out_path) {
+    /* the writer streams from the input while writing, opening the output would truncate it */
+    if (same_file(argv[optind], out_path))
+      bye("refusing to write %s over its own input\n", out_path);
+    dumping = 0;
+  }
 
-  fp = fopen(argv[1], "r");
+  fp = fopen(argv[optind], "r");
 
   if (!fp) {
-    bye("could not open wasm file: %s\n", argv[1]);
+    bye("could not open wasm file: %s\n", argv[optind]);
     return 1;
   }
 
@@ -378,7 +483,16 @@ int main(int argc, char **argv) {
     read_section(fp, &m);
   } while (ftell(fp) < file_size);
 
-  pretty_print_module(&m);
+  if (out_path) {
+    out = fopen(out_path, "w");
+    if (!out) {
+      bye("could not open output file: %s\n", out_path);
+    }
+    write_module(&m, fp, out, &opts);
+    fclose(out);
+  } else {
+    pretty_print_module(&m);
+  }
 
   /* XXX: free malloc'd sections */
 }
@@ -0,0 +1,1112 @@
+/*
+ * writer.c - re-encodes a parsed module back into binary wasm.
+ *
+ * The sections we parse (type, function, export, code) are written out of the module_t, the other
+ * known sections are walked and re-encoded, and custom sections are copied from the input file
+ * using the offsets recorded while reading. Every LEB128 we emit, including the immediates of the
+ * instructions we walk, is minimal length.
+ *
+ * Two optional passes renumber things: merging identical function signatures changes type indices
+ * and moving hot functions to the front changes function indices. Every function body is walked,
+ * but it is streamed straight out of the input file unless the walk changed its bytes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "s_wasm.h"
+
+#define COPY_CHUNK 0x10000
+
+/* growable output buffer for the sections (and function bodies) we have to re-encode */
+typedef struct {
+  byte *data;
+  size_t len;
+  size_t cap;
+} buf_t;
+
+/* read position inside an in-memory copy of a section or function body */
+typedef struct {
+  const byte *p;
+  const byte *end;
+} cursor_t;
+
+/* old index -> new index maps. A NULL map means the index space was left alone. */
+typedef struct {
+  u32 *types;
+  u32 ntypes;
+  u32 *funcs;
+  u32 nfuncs;
+} remap_t;
+
+/*
+ * what write_module() emits for one section: nothing, the contents re-encoded into b, or (if
+ * neither) the original contents copied from the input file behind a minimal length.
+ */
+typedef struct {
+  int drop;
+  int rebuilt;
+  buf_t b;
+} plan_t;
+
+/* the code section is planned body by body, bodies with no data are copied from the input file */
+typedef struct {
+  buf_t *bodies;
+  size_t len;
+} codeplan_t;
+
+void buf_put_bytes(buf_t *b, const byte *p, size_t n) {
+  if (b->len + n > b->cap) {
+    b->cap = (b->len + n) * 2;
+    b->data = realloc(b->data, b->cap);
+  }
+  memcpy(b->data + b->len, p, n);
+  b->len += n;
+}
+
+void buf_put_byte(buf_t *b, byte c) {
+  buf_put_bytes(b, &c, 1);
+}
+
+void buf_put_u64(buf_t *b, u64 v) {
+  /* unsigned LEB128, the shortest encoding is the canonical one */
+  byte c;
+
+  do {
+    c = v & 0x7f;
+    v >>= 7;
+    if (v)
+      c |= 0x80;
+    buf_put_byte(b, c);
+  } while (v);
+}
+
+void buf_put_u32(buf_t *b, u32 v) {
+  buf_put_u64(b, v);
+}
+
+void buf_put_s64(buf_t *b, i64 v) {
+  /* signed LEB128, we are done once the remaining bits are all copies of the sign bit */
+  byte c;
+  int more;
+
+  do {
+    c = v & 0x7f;
+    v >>= 7;
+    more = !((v == 0 && !(c & 0x40)) || (v == -1 && (c & 0x40)));
+    if (more)
+      c |= 0x80;
+    buf_put_byte(b, c);
+  } while (more);
+}
+
+void buf_put_name(buf_t *b, byte *name) {
+  size_t len = strlen((char *)name);
+
+  buf_put_u32(b, len);
+  buf_put_bytes(b, name, len);
+}
+
+int u32_size(u32 v) {
+  int n = 1;
+
+  while (v >>= 7)
+    n++;
+  return n;
+}
+
+void write_u32(FILE *out, u32 v) {
+  buf_t b = {0};
+
+  buf_put_u32(&b, v);
+  fwrite(b.data, 1, b.len, out);
+  free(b.data);
+}
+
+void write_section(FILE *out, byte type, buf_t *b) {
+  fputc(type, out);
+  write_u32(out, b->len);
+  fwrite(b->data, 1, b->len, out);
+}
+
+void copy_range(FILE *in, FILE *out, size_t offset, size_t len) {
+  byte chunk[COPY_CHUNK];
+  size_t n;
+
+  if ((size_t)ftell(in) != offset)
+    fseek(in, offset, SEEK_SET);
+
+  while (len) {
+    n = len < COPY_CHUNK ? len : COPY_CHUNK;
+    read_many_bytes(in, n, chunk);
+    fwrite(chunk, 1, n, out);
+    len -= n;
+  }
+}
+
+byte *load_range(FILE *in, size_t offset, size_t len) {
+  byte *p;
+
+  p = malloc(len ? len : 1);
+  fseek(in, offset, SEEK_SET);
+  read_many_bytes(in, len, p);
+  return p;
+}
+
+byte take_byte(cursor_t *c, buf_t *out) {
+  if (c->p >= c->end)
+    bye("ran off the end of a section while re-encoding\n");
+  buf_put_byte(out, *c->p);
+  return *c->p++;
+}
+
+void take_bytes(cursor_t *c, buf_t *out, size_t n) {
+  if ((size_t)(c->end - c->p) < n)
+    bye("ran off the end of a section while re-encoding\n");
+  buf_put_bytes(out, c->p, n);
+  c->p += n;
+}
+
+u64 get_leb(cursor_t *c, int *len) {
+  /* decodes an unsigned LEB128 of up to 64 bits, len gets the number of bytes it took */
+  u64 v = 0;
+  byte b;
+  int n = 0;
+
+  do {
+    if (c->p >= c->end || n == 10)
+      bye("bad LEB128 encoding while re-encoding\n");
+    b = *c->p++;
+    v |= (u64)(b & 0x7f) << (n * 7);
+    n++;
+  } while (b & 0x80);
+
+  *len = n;
+  return v;
+}
+
+u32 take_u32(cursor_t *c, buf_t *out) {
+  /* re-encodes an unsigned LEB128 (u32 or u64) at minimal length and hands back its value */
+  u64 v;
+  int len;
+
+  v = get_leb(c, &len);
+  buf_put_u64(out, v);
+  return v;
+}
+
+void take_s64(cursor_t *c, buf_t *out) {
+  /* same for a signed LEB128 (s32, s33 or s64): sign extend from the last byte we read */
+  u64 v;
+  int len;
+
+  v = get_leb(c, &len);
+  if (len * 7 < 64 && (c->p[-1] & 0x40))
+    v |= ~(u64)0 << (len * 7);
+  buf_put_s64(out, (i64)v);
+}
+
+void take_idx(cursor_t *c, buf_t *out, u32 *map, u32 n) {
+  u32 v;
+  int len;
+
+  v = get_leb(c, &len);
+  if (map) {
+    if (v >= n)
+      bye("index %u is out of range (%u) while re-encoding\n", v, n);
+    v = map[v];
+  }
+  buf_put_u32(out, v);
+}
+
+void take_blocktype(cursor_t *c, buf_t *out, remap_t *r) {
+  /*
+   * blocktype ::= 0x40     ⇒ 𝜖
+   *            |  𝑡:valtype ⇒ 𝑡
+   *            |  𝑥:s33     ⇒ 𝑥 (if 𝑥 ≥ 0)
+   *
+   * The first two are single bytes that read as negative s33 values.
+   */
+  const byte *start = c->p;
+  u64 v;
+  int len;
+
+  v = get_leb(c, &len);
+  if (len == 1 && (v & 0x40)) {
+    buf_put_byte(out, *start);
+    return;
+  }
+  if (r->types) {
+    if (v >= r->ntypes)
+      bye("block type index %u is out of range (%u) while re-encoding\n", (u32)v, r->ntypes);
+    v = r->types[v];
+  }
+  buf_put_s64(out, v);
+}
+
+void take_memarg(cursor_t *c, buf_t *out) {
+  /*
+   * memarg ::= 𝑎:u32 𝑜:u32 ⇒ {align 𝑎, offset 𝑜}
+   *
+   * with multiple memories bit 6 of the alignment says a memidx follows.
+   */
+  u32 align;
+
+  align = take_u32(c, out);
+  if (align & 0x40)
+    take_u32(c, out);
+  take_u32(c, out);
+}
+
+void take_limits(cursor_t *c, buf_t *out) {
+  byte flags;
+
+  flags = take_byte(c, out);
+  take_u32(c, out);
+  if (flags & 0x1)
+    take_u32(c, out);
+}
+
+void rewrite_fc_instr(cursor_t *c, buf_t *out) {
+  /* 0xFC prefix: saturating truncation, bulk memory and table instructions */
+  u32 sub;
+
+  sub = take_u32(c, out);
+  if (sub <= 7)
+    return;
+
+  switch (sub) {
+  case 8:  /* memory.init */
+  case 10: /* memory.copy */
+  case 12: /* table.init */
+  case 14: /* table.copy */
+    take_u32(c, out);
+    take_u32(c, out);
+    break;
+  case 9:  /* data.drop */
+  case 11: /* memory.fill */
+  case 13: /* elem.drop */
+  case 15: /* table.grow */
+  case 16: /* table.size */
+  case 17: /* table.fill */
+    take_u32(c, out);
+    break;
+  default:
+    bye("unknown instruction 0xfc %u\n", sub);
+  }
+}
+
+void rewrite_fd_instr(cursor_t *c, buf_t *out) {
+  /* 0xFD prefix: vector instructions, most of them have no immediates */
+  u32 sub;
+
+  sub = take_u32(c, out);
+  if (sub <= 0x0b || sub == 0x5c || sub == 0x5d) {
+    /* v128.load*, v128.store, v128.load*_zero */
+    take_memarg(c, out);
+  } else if (sub == 0x0c || sub == 0x0d) {
+    /* v128.const, i8x16.shuffle */
+    take_bytes(c, out, 16);
+  } else if (sub >= 0x15 && sub <= 0x22) {
+    /* extract_lane, replace_lane */
+    take_bytes(c, out, 1);
+  } else if (sub >= 0x54 && sub <= 0x5b) {
+    /* v128.load*_lane, v128.store*_lane */
+    take_memarg(c, out);
+    take_bytes(c, out, 1);
+  }
+}
+
+void rewrite_fe_instr(cursor_t *c, buf_t *out) {
+  /* 0xFE prefix: atomics, everything but atomic.fence takes a memarg */
+  u32 sub;
+
+  sub = take_u32(c, out);
+  if (sub == 0x03)
+    take_bytes(c, out, 1);
+  else
+    take_memarg(c, out);
+}
+
+void rewrite_catches(cursor_t *c, buf_t *out) {
+  /*
+   * catch ::= 0x00 𝑥:tagidx 𝑙:labelidx ⇒ catch 𝑥 𝑙
+   *        |  0x01 𝑥:tagidx 𝑙:labelidx ⇒ catch_ref 𝑥 𝑙
+   *        |  0x02 𝑙:labelidx          ⇒ catch_all 𝑙
+   *        |  0x03 𝑙:labelidx          ⇒ catch_all_ref 𝑙
+   *
+   * Tags never move, so there is nothing to remap here.
+   */
+  u32 n;
+  byte kind;
+
+  n = take_u32(c, out);
+  while (n--) {
+    kind = take_byte(c, out);
+    if (kind > 0x3)
+      bye("unexpected catch clause(%#x)\n", kind);
+    if (kind <= 0x1)
+      take_u32(c, out);
+    take_u32(c, out);
+  }
+}
+
+byte rewrite_instr(cursor_t *c, buf_t *out, remap_t *r) {
+  /*
+   * Copies one instruction to out, rewriting any type or function index it carries. We only need
+   * to know the shape of the immediates here, not what the instruction does.
+   */
+  byte op;
+  u32 n;
+
+  op = take_byte(c, out);
+
+  if (op >= 0x28 && op <= 0x3e) {
+    /* loads and stores */
+    take_memarg(c, out);
+    return op;
+  }
+  if (op >= 0x45 && op <= 0xc4) {
+    /* numeric instructions other than the constants have no immediates */
+    return op;
+  }
+
+  switch (op) {
+  case 0x00: /* unreachable */
+  case 0x01: /* nop */
+  case 0x05: /* else */
+  case 0x0a: /* throw_ref */
+  case 0x0b: /* end */
+  case 0x0f: /* return */
+  case 0x19: /* catch_all */
+  case 0x1a: /* drop */
+  case 0x1b: /* select */
+  case 0xd1: /* ref.is_null */
+    break;
+  case 0x02: /* block */
+  case 0x03: /* loop */
+  case 0x04: /* if */
+  case 0x06: /* try */
+    take_blocktype(c, out, r);
+    break;
+  case 0x1f: /* try_table */
+    take_blocktype(c, out, r);
+    rewrite_catches(c, out);
+    break;
+  case 0x07: /* catch */
+  case 0x08: /* throw */
+  case 0x09: /* rethrow */
+  case 0x18: /* delegate */
+  case 0x0c: /* br */
+  case 0x0d: /* br_if */
+  case 0x20: /* local.get */
+  case 0x21: /* local.set */
+  case 0x22: /* local.tee */
+  case 0x23: /* global.get */
+  case 0x24: /* global.set */
+  case 0x25: /* table.get */
+  case 0x26: /* table.set */
+  case 0x3f: /* memory.size */
+  case 0x40: /* memory.grow */
+    take_u32(c, out);
+    break;
+  case 0x41: /* i32.const */
+  case 0x42: /* i64.const */
+  case 0xd0: /* ref.null */
+    take_s64(c, out);
+    break;
+  case 0x0e: /* br_table */
+    n = take_u32(c, out);
+    while (n--)
+      take_u32(c, out);
+    take_u32(c, out);
+    break;
+  case 0x10: /* call */
+  case 0x12: /* return_call */
+  case 0xd2: /* ref.func */
+    take_idx(c, out, r->funcs, r->nfuncs);
+    break;
+  case 0x11: /* call_indirect */
+  case 0x13: /* return_call_indirect */
+    take_idx(c, out, r->types, r->ntypes);
+    take_u32(c, out);
+    break;
+  case 0x1c: /* select t* */
+    n = take_u32(c, out);
+    take_bytes(c, out, n);
+    break;
+  case 0x43: /* f32.const */
+    take_bytes(c, out, 4);
+    break;
+  case 0x44: /* f64.const */
+    take_bytes(c, out, 8);
+    break;
+  case 0xfc:
+    rewrite_fc_instr(c, out);
+    break;
+  case 0xfd:
+    rewrite_fd_instr(c, out);
+    break;
+  case 0xfe:
+    rewrite_fe_instr(c, out);
+    break;
+  default:
+    bye("unknown instruction(%#x) while re-encoding\n", op);
+  }
+  return op;
+}
+
+void rewrite_expr(cursor_t *c, buf_t *out, remap_t *r) {
+  /* constant expressions: no blocks, so the first end finishes the expression */
+  while (rewrite_instr(c, out, r) != 0x0b);
+}
+
+void rewrite_body(cursor_t *c, buf_t *out, remap_t *r) {
+  /*
+   * func   ::= (t*)*:vec(locals) e:expr
+   * locals ::= n:u32 t:valtype
+   */
+  u32 n;
+
+  n = take_u32(c, out);
+  while (n--) {
+    take_u32(c, out);
+    take_byte(c, out);
+  }
+  while (c->p < c->end)
+    rewrite_instr(c, out, r);
+}
+
+u32 rewrite_importsec(cursor_t *c, buf_t *out, remap_t *r) {
+  /*
+   * import     ::= mod:name nm:name d:importdesc
+   * importdesc ::= 0x00 𝑥:typeidx    ⇒ func 𝑥
+   *             |  0x01 tt:tabletype ⇒ table tt
+   *             |  0x02 mt:memtype   ⇒ mem mt
+   *             |  0x03 gt:globaltype ⇒ global gt
+   *             |  0x04 0x00 𝑥:typeidx ⇒ tag 𝑥
+   *
+   * Returns the number of imported functions, they come first in the function index space.
+   */
+  u32 n, nfuncs = 0;
+  byte desc;
+
+  n = take_u32(c, out);
+  while (n--) {
+    take_bytes(c, out, take_u32(c, out));
+    take_bytes(c, out, take_u32(c, out));
+
+    desc = take_byte(c, out);
+    switch (desc) {
+    case 0x0:
+      take_idx(c, out, r->types, r->ntypes);
+      nfuncs++;
+      break;
+    case 0x1:
+      take_byte(c, out);
+      take_limits(c, out);
+      break;
+    case 0x2:
+      take_limits(c, out);
+      break;
+    case 0x3:
+      take_bytes(c, out, 2);
+      break;
+    case 0x4:
+      take_byte(c, out);
+      take_idx(c, out, r->types, r->ntypes);
+      break;
+    default:
+      bye("unexpected import type(%#x)\n", desc);
+    }
+  }
+  return nfuncs;
+}
+
+void rewrite_tablesec(cursor_t *c, buf_t *out, remap_t *r) {
+  /*
+   * tabletype ::= et:reftype lim:limits
+   */
+  u32 n;
+
+  n = take_u32(c, out);
+  while (n--) {
+    take_byte(c, out);
+    take_limits(c, out);
+  }
+}
+
+void rewrite_memsec(cursor_t *c, buf_t *out, remap_t *r) {
+  /*
+   * memtype ::= lim:limits
+   */
+  u32 n;
+
+  n = take_u32(c, out);
+  while (n--)
+    take_limits(c, out);
+}
+
+void rewrite_globalsec(cursor_t *c, buf_t *out, remap_t *r) {
+  /*
+   * global     ::= gt:globaltype e:expr
+   * globaltype ::= t:valtype m:mut
+   */
+  u32 n;
+
+  n = take_u32(c, out);
+  while (n--) {
+    take_bytes(c, out, 2);
+    rewrite_expr(c, out, r);
+  }
+}
+
+void rewrite_elemsec(cursor_t *c, buf_t *out, remap_t *r) {
+  /*
+   * The leading u32 of an element segment is a bitfield:
+   *   bit 0: passive or declarative (set) vs active (clear)
+   *   bit 1: an explicit table index (active) or declarative (passive)
+   *   bit 2: elements are expressions rather than function indices
+   * Active segments start with an offset expression, non zero flags carry an elemkind/reftype.
+   */
+  u32 n, flags, nelts;
+
+  n = take_u32(c, out);
+  while (n--) {
+    flags = take_u32(c, out);
+    if (flags > 7)
+      bye("unexpected element segment type(%u)\n", flags);
+
+    if (!(flags & 0x1)) {
+      if (flags & 0x2)
+        take_u32(c, out);
+      rewrite_expr(c, out, r);
+    }
+    if (flags & 0x3)
+      take_byte(c, out);
+
+    nelts = take_u32(c, out);
+    while (nelts--) {
+      if (flags & 0x4)
+        rewrite_expr(c, out, r);
+      else
+        take_idx(c, out, r->funcs, r->nfuncs);
+    }
+  }
+}
+
+void rewrite_datasec(cursor_t *c, buf_t *out, remap_t *r) {
+  /*
+   * data ::= 0:u32 𝑒:expr 𝑏*:vec(byte)          ⇒ active memory 0
+   *       |  1:u32 𝑏*:vec(byte)                 ⇒ passive
+   *       |  2:u32 𝑥:memidx 𝑒:expr 𝑏*:vec(byte) ⇒ active memory 𝑥
+   */
+  u32 n, flags;
+
+  n = take_u32(c, out);
+  while (n--) {
+    flags = take_u32(c, out);
+    if (flags > 2)
+      bye("unexpected data segment type(%u)\n", flags);
+    if (flags == 2)
+      take_u32(c, out);
+    if (flags != 1)
+      rewrite_expr(c, out, r);
+    take_bytes(c, out, take_u32(c, out));
+  }
+}
+
+void rewrite_datacountsec(cursor_t *c, buf_t *out, remap_t *r) {
+  take_u32(c, out);
+}
+
+void rewrite_tagsec(cursor_t *c, buf_t *out, remap_t *r) {
+  /*
+   * tag ::= 0x00 𝑥:typeidx
+   */
+  u32 n;
+
+  n = take_u32(c, out);
+  while (n--) {
+    take_byte(c, out);
+    take_idx(c, out, r->types, r->ntypes);
+  }
+}
+
+void rewrite_namesec(cursor_t *c, buf_t *out, remap_t *r) {
+  /*
+   * namesec ::= section0(namedata)
+   * namedata ::= n:name (if n = 'name') namesubsec*
+   * namesubsec ::= N:byte size:u32 B (if size = ||B||)
+   *
+   * Only called once type indices have changed: the type names subsection (4) is keyed by them
+   * and is dropped, the rest is copied.
+   */
+  u32 n;
+  byte id;
+  int len;
+
+  n = take_u32(c, out);
+  take_bytes(c, out, n);
+  while (c->p < c->end) {
+    id = *c->p++;
+    n = get_leb(c, &len);
+    if ((size_t)(c->end - c->p) < n)
+      bye("name subsection %u runs off the end of the section\n", id);
+    if (id == 0x4) {
+      fprintf(stderr, "dropping the type names, type indices have changed\n");
+      c->p += n;
+      continue;
+    }
+    buf_put_byte(out, id);
+    buf_put_u32(out, n);
+    take_bytes(c, out, n);
+  }
+}
+
+int functype_eq(functype_t *a, functype_t *b) {
+  return a->parameters->nelts == b->parameters->nelts
+    && a->results->nelts == b->results->nelts
+    && !memcmp(a->parameters->pvaltypes, b->parameters->pvaltypes, a->parameters->nelts)
+    && !memcmp(a->results->pvaltypes, b->results->pvaltypes, a->results->nelts);
+}
+
+u32 *dedup_types(module_t *m, byte *keep) {
+  /*
+   * Every signature maps onto the first identical one. Returns NULL if there was nothing to merge.
+   */
+  vector_t *v = m->typesec->v;
+  u32 *map, i, j, next = 0;
+
+  map = calloc(v->nelts, sizeof(u32));
+
+  for (i = 0; i < v->nelts; i++) {
+    for (j = 0; j < i; j++) {
+      if (keep[j] && functype_eq(v->pfuncs[i], v->pfuncs[j]))
+        break;
+    }
+    if (j < i) {
+      map[i] = map[j];
+    } else {
+      keep[i] = 1;
+      map[i] = next++;
+    }
+  }
+
+  if (next == v->nelts) {
+    free(map);
+    return NULL;
+  }
+  return map;
+}
+
+u32 *order_funcs(u32 *hot, u32 nhot, u32 nimports, u32 ndefined, u32 *order) {
+  /*
+   * order[] gets the old position of every function body in its new position: the hot functions
+   * in profile order, then everything else as it was. Returns the old -> new function index map,
+   * or NULL if nothing moves. Imported functions can't move.
+   */
+  byte *placed;
+  u32 *map, i, k = 0, nfuncs = nimports + ndefined;
+
+  placed = calloc(ndefined ? ndefined : 1, 1);
+
+  for (i = 0; i < nhot; i++) {
+    if (hot[i] < nimports || hot[i] >= nfuncs || placed[hot[i] - nimports])
+      continue;
+    placed[hot[i] - nimports] = 1;
+    order[k++] = hot[i] - nimports;
+  }
+  for (i = 0; i < ndefined; i++) {
+    if (!placed[i])
+      order[k++] = i;
+  }
+  free(placed);
+
+  for (i = 0; i < ndefined && order[i] == i; i++);
+  if (i == ndefined)
+    return NULL;
+
+  map = calloc(nfuncs, sizeof(u32));
+  for (i = 0; i < nimports; i++)
+    map[i] = i;
+  for (i = 0; i < ndefined; i++)
+    map[nimports + order[i]] = nimports + i;
+  return map;
+}
+
+u32 count_func_imports(module_t *m, FILE *in) {
+  section_t *s;
+  cursor_t c;
+  buf_t scratch = {0};
+  remap_t none = {0};
+  byte *data;
+  u32 n = 0;
+
+  for (s = m->sections; s; s = s->next) {
+    if (s->type == 0x2) {
+      data = load_range(in, s->content, s->len);
+      c.p = data;
+      c.end = data + s->len;
+      n = rewrite_importsec(&c, &scratch, &none);
+      free(data);
+    }
+  }
+  free(scratch.data);
+  return n;
+}
+
+int strip_custom(section_t *s, writer_opts_t *opts, remap_t *r) {
+  int i;
+
+  for (i = 0; i < opts->nstrip; i++) {
+    if (!strcmp(opts->strip[i], (char *)s->name))
+      return 1;
+  }
+  if (r->funcs && !strcmp("name", (char *)s->name)) {
+    /* the name section is keyed by function index, we don't rewrite it */
+    fprintf(stderr, "dropping the name section, function indices have changed\n");
+    return 1;
+  }
+  return 0;
+}
+
+int offset_keyed(section_t *s) {
+  /*
+   * custom sections that point into the module by byte offset (or, for linking, also by index)
+   * and go stale as soon as anything before what they point at changes size
+   */
+  const char *name = (char *)s->name;
+
+  return !strcmp(name, "linking") || !strncmp(name, "reloc.", 6) || !strncmp(name, ".debug_", 7)
+    || !strcmp(name, "sourceMappingURL");
+}
+
+int header_changed(section_t *s) {
+  return s->content - s->offset - 1 != (size_t)u32_size(s->len);
+}
+
+int plan_changed(FILE *in, section_t *s, plan_t *p) {
+  byte *data;
+  int changed;
+
+  if (header_changed(s))
+    return 1;
+  if (!p->rebuilt)
+    return 0;
+  if (p->b.len != s->len)
+    return 1;
+
+  data = load_range(in, s->content, s->len);
+  changed = memcmp(data, p->b.data, s->len) != 0;
+  free(data);
+  return changed;
+}
+
+int codeplan_changed(section_t *s, codeplan_t *cp, remap_t *r, u32 n) {
+  u32 i;
+
+  /* reordered bodies can keep every byte and the total length, but not their offsets */
+  if (r->funcs || header_changed(s) || cp->len != s->len)
+    return 1;
+  for (i = 0; i < n; i++) {
+    if (cp->bodies[i].data)
+      return 1;
+  }
+  return 0;
+}
+
+void rewrite_range(FILE *in, section_t *s, remap_t *r, buf_t *out,
+                   void (*rewrite)(cursor_t *, buf_t *, remap_t *)) {
+  cursor_t c;
+  byte *data;
+
+  data = load_range(in, s->content, s->len);
+  c.p = data;
+  c.end = data + s->len;
+  rewrite(&c, out, r);
+  if (c.p != c.end)
+    bye("section type(%#x) has %lu trailing bytes\n", s->type, (unsigned long)(c.end - c.p));
+  free(data);
+}
+
+void rewrite_importsec_cb(cursor_t *c, buf_t *out, remap_t *r) {
+  rewrite_importsec(c, out, r);
+}
+
+void rewrite_startsec(cursor_t *c, buf_t *out, remap_t *r) {
+  take_idx(c, out, r->funcs, r->nfuncs);
+}
+
+void build_typesec(buf_t *b, module_t *m, byte *keep) {
+  /*
+   * functype ::= 0x60 rt1:resulttype rt2:resulttype
+   */
+  vector_t *v = m->typesec->v;
+  u32 i, n = 0;
+
+  for (i = 0; i < v->nelts; i++)
+    n += keep[i];
+
+  buf_put_u32(b, n);
+  for (i = 0; i < v->nelts; i++) {
+    if (!keep[i])
+      continue;
+    buf_put_byte(b, 0x60);
+    buf_put_u32(b, v->pfuncs[i]->parameters->nelts);
+    buf_put_bytes(b, v->pfuncs[i]->parameters->pvaltypes, v->pfuncs[i]->parameters->nelts);
+    buf_put_u32(b, v->pfuncs[i]->results->nelts);
+    buf_put_bytes(b, v->pfuncs[i]->results->pvaltypes, v->pfuncs[i]->results->nelts);
+  }
+}
+
+void build_funcsec(buf_t *b, module_t *m, remap_t *r, u32 *order) {
+  vector_t *v = m->funcsec->v;
+  u32 i, idx;
+
+  buf_put_u32(b, v->nelts);
+  for (i = 0; i < v->nelts; i++) {
+    idx = v->pindices[order[i]];
+    if (r->types) {
+      if (idx >= r->ntypes)
+        bye("function %u has a bad type index %u\n", order[i], idx);
+      idx = r->types[idx];
+    }
+    buf_put_u32(b, idx);
+  }
+}
+
+void build_exportssec(buf_t *b, module_t *m, remap_t *r) {
+  vector_t *v = m->exportssec->v;
+  u32 i, idx;
+
+  buf_put_u32(b, v->nelts);
+  for (i = 0; i < v->nelts; i++) {
+    idx = v->pexports[i]->idx;
+    if (v->pexports[i]->desc == 0x0 && r->funcs) {
+      if (idx >= r->nfuncs)
+        bye("export %s has a bad function index %u\n", v->pexports[i]->name, idx);
+      idx = r->funcs[idx];
+    }
+    buf_put_name(b, v->pexports[i]->name);
+    buf_put_byte(b, v->pexports[i]->desc);
+    buf_put_u32(b, idx);
+  }
+}
+
+void plan_codesec(FILE *in, module_t *m, remap_t *r, u32 *order, codeplan_t *cp) {
+  /*
+   * Every body is read and walked, which remaps its indices and shortens any padded LEB128. Only
+   * the bodies that came out different are kept, the others are streamed from the input file by
+   * write_codesec(), so they are never held in memory longer than it takes to walk them.
+   */
+  vector_t *v = m->codesec->v;
+  buf_t scratch = {0};
+  byte *body = NULL;
+  size_t body_cap = 0, len;
+  cursor_t c;
+  code_t *code;
+  u32 i;
+
+  cp->bodies = calloc(v->nelts ? v->nelts : 1, sizeof(buf_t));
+  cp->len = u32_size(v->nelts);
+
+  for (i = 0; i < v->nelts; i++) {
+    code = v->pcodes[order[i]];
+    len = code->size;
+
+    if (code->size > body_cap) {
+      body_cap = code->size;
+      body = realloc(body, body_cap);
+    }
+    if ((size_t)ftell(in) != code->offset)
+      fseek(in, code->offset, SEEK_SET);
+    read_many_bytes(in, code->size, body);
+
+    c.p = body;
+    c.end = body + code->size;
+    scratch.len = 0;
+    rewrite_body(&c, &scratch, r);
+
+    if (scratch.len != code->size || memcmp(scratch.data, body, code->size)) {
+      buf_put_bytes(&cp->bodies[i], scratch.data, scratch.len);
+      len = scratch.len;
+    }
+    cp->len += u32_size(len) + len;
+  }
+  free(body);
+  free(scratch.data);
+}
+
+void write_codesec(FILE *out, FILE *in, module_t *m, codeplan_t *cp, u32 *order) {
+  vector_t *v = m->codesec->v;
+  code_t *code;
+  u32 i;
+
+  fputc(0xa, out);
+  write_u32(out, cp->len);
+  write_u32(out, v->nelts);
+
+  for (i = 0; i < v->nelts; i++) {
+    code = v->pcodes[order[i]];
+    if (cp->bodies[i].data) {
+      write_u32(out, cp->bodies[i].len);
+      fwrite(cp->bodies[i].data, 1, cp->bodies[i].len, out);
+      free(cp->bodies[i].data);
+    } else {
+      write_u32(out, code->size);
+      copy_range(in, out, code->offset, code->size);
+    }
+  }
+  free(cp->bodies);
+}
+
+void write_module(module_t *m, FILE *in, FILE *out, writer_opts_t *opts) {
+  /*
+   * Every section is planned up front, so we know whether anything moves before the first byte
+   * goes out. If it does, the custom sections that point into the module by offset are dropped.
+   */
+  static const byte preamble[] = {0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00};
+  remap_t r = {0};
+  section_t *s;
+  plan_t *plans, *p;
+  codeplan_t cp = {0};
+  byte *keep = NULL;
+  u32 *order, i, ndefined, nimports, nsections = 0;
+  int moved = 0, dropped = 0;
+
+  ndefined = m->funcsec ? m->funcsec->v->nelts : 0;
+  if (m->codesec && m->codesec->v->nelts != ndefined)
+    bye("function section has %u entries, but the code section has %u\n", ndefined,
+        m->codesec->v->nelts);
+
+  if (m->typesec) {
+    r.ntypes = m->typesec->v->nelts;
+    keep = calloc(r.ntypes ? r.ntypes : 1, 1);
+    if (opts->dedup_types)
+      r.types = dedup_types(m, keep);
+    else
+      memset(keep, 1, r.ntypes);
+  }
+
+  order = calloc(ndefined ? ndefined : 1, sizeof(u32));
+  for (i = 0; i < ndefined; i++)
+    order[i] = i;
+  if (opts->hot) {
+    nimports = count_func_imports(m, in);
+    r.nfuncs = nimports + ndefined;
+    r.funcs = order_funcs(opts->hot, opts->nhot, nimports, ndefined, order);
+  }
+
+  for (s = m->sections; s; s = s->next)
+    nsections++;
+  plans = calloc(nsections ? nsections : 1, sizeof(plan_t));
+
+  for (s = m->sections, p = plans; s; s = s->next, p++) {
+    p->rebuilt = 1;
+
+    if (s->type == 0x0) {
+      p->drop = strip_custom(s, opts, &r);
+      p->rebuilt = 0;
+      if (!p->drop && r.types && !strcmp("name", (char *)s->name)) {
+        rewrite_range(in, s, &r, &p->b, rewrite_namesec);
+        p->rebuilt = 1;
+      }
+    } else if (s == m->typesec) {
+      build_typesec(&p->b, m, keep);
+    } else if (s == m->funcsec) {
+      build_funcsec(&p->b, m, &r, order);
+    } else if (s == m->exportssec) {
+      build_exportssec(&p->b, m, &r);
+    } else if (s == m->codesec) {
+      plan_codesec(in, m, &r, order, &cp);
+      p->rebuilt = 0;
+    } else if (s->type == 0x2) {
+      rewrite_range(in, s, &r, &p->b, rewrite_importsec_cb);
+    } else if (s->type == 0x4) {
+      rewrite_range(in, s, &r, &p->b, rewrite_tablesec);
+    } else if (s->type == 0x5) {
+      rewrite_range(in, s, &r, &p->b, rewrite_memsec);
+    } else if (s->type == 0x6) {
+      rewrite_range(in, s, &r, &p->b, rewrite_globalsec);
+    } else if (s->type == 0x8) {
+      rewrite_range(in, s, &r, &p->b, rewrite_startsec);
+    } else if (s->type == 0x9) {
+      rewrite_range(in, s, &r, &p->b, rewrite_elemsec);
+    } else if (s->type == 0xb) {
+      rewrite_range(in, s, &r, &p->b, rewrite_datasec);
+    } else if (s->type == 0xc) {
+      rewrite_range(in, s, &r, &p->b, rewrite_datacountsec);
+    } else if (s->type == 0xd) {
+      rewrite_range(in, s, &r, &p->b, rewrite_tagsec);
+    } else {
+      p->rebuilt = 0;
+    }
+  }
+
+  /* dropping a custom section only moves things if a real section comes after it */
+  for (s = m->sections, p = plans; s && !moved; s = s->next, p++) {
+    if (p->drop)
+      dropped = 1;
+    else if (s == m->codesec)
+      moved = dropped || codeplan_changed(s, &cp, &r, ndefined);
+    else
+      moved = (dropped && s->type != 0x0) || plan_changed(in, s, p);
+  }
+
+  for (s = m->sections, p = plans; moved && s; s = s->next, p++) {
+    if (s->type == 0x0 && !p->drop && offset_keyed(s)) {
+      fprintf(stderr, "dropping the %s section, the module layout has changed\n", s->name);
+      p->drop = 1;
+    }
+  }
+
+  fwrite(preamble, 1, sizeof(preamble), out);
+
+  for (s = m->sections, p = plans; s; s = s->next, p++) {
+    if (p->drop)
+      continue;
+
+    if (s == m->codesec) {
+      write_codesec(out, in, m, &cp, order);
+    } else if (p->rebuilt) {
+      write_section(out, s->type, &p->b);
+    } else {
+      fputc(s->type, out);
+      write_u32(out, s->len);
+      copy_range(in, out, s->content, s->len);
+    }
+    free(p->b.data);
+  }
+
+  free(plans);
+  free(keep);
+  free(order);
+  free(r.types);
+  free(r.funcs);
+}
+
+u32 *read_hot_profile(const char *path, u32 *n) {
+  /*
+   * one function index per line, hottest first
+   */
+  FILE *fp;
+  u32 *hot = NULL, idx, cap = 0;
+
+  fp = fopen(path, "r");
+  if (!fp)
+    bye("could not open hot function profile: %s\n", path);
+
+  *n = 0;
+  while (fscanf(fp, "%u", &idx) == 1) {
+    if (*n == cap) {
+      cap = cap ? cap * 2 : VEC_DEFAULT_SIZE;
+      hot = realloc(hot, cap * sizeof(u32));
+    }
+    hot[(*n)++] = idx;
+  }
+  if (!feof(fp))
+    bye("hot function profile %s should only contain function indices\n", path);
+
+  fclose(fp);
+  return hot;
+}